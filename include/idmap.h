@@ -11,20 +11,54 @@
 
 struct idmap;
 
+// One stage of a chain of maps. Any of the paths may be NULL.
+struct idmap_mapfiles {
+	const char* user_map,* group_map,* user_group_map;
+};
+
 struct idmap* idmap_open(void);
 struct idmap* idmap_open_with_mapfiles(const char* user_map, const char* group_map, const char* user_group_map);
+struct idmap* idmap_open_with_mapfile_chain(const struct idmap_mapfiles* chain, size_t count);
 void idmap_close(struct idmap* map);
 
 bool idmap_add_user(struct idmap*, uid_t from_user, uid_t to_user);
 bool idmap_add_group(struct idmap*, gid_t from_group, gid_t to_group);
 bool idmap_add_user_group_pair(struct idmap*, uid_t from_user, gid_t from_group, uid_t to_user, gid_t to_group);
+bool idmap_add_user_any_group(struct idmap*, uid_t from_user, uid_t to_user);
+bool idmap_add_group_any_user(struct idmap*, gid_t from_group, gid_t to_group);
 
 bool idmap_read_users(struct idmap*, FILE* mapfile);
 bool idmap_read_groups(struct idmap*, FILE* mapfile);
 bool idmap_read_user_group_pairs(struct idmap*, FILE* mapfile);
 
 bool idmap_read_mapfiles(struct idmap*, const char* user_map, const char* group_map, const char* user_group_map);
+bool idmap_read_mapfile_chain(struct idmap*, const struct idmap_mapfiles* chain, size_t count);
+
+// Replaces map with the result of applying map and then next, flattened so that lookups remain a single pass
+bool idmap_compose(struct idmap* map, const struct idmap* next);
+
+// Bulk construction for maps generated programmatically. Tables are sized from the hints, the last being
+// the number of distinct users that have pair rules, and large batches are sorted to fill them in order.
+// This isn't free of allocation: sorting uses scratch memory of twice the largest batch, held until the
+// builder is finished, and each user with pair rules still gets a table of groups allocated.
+// finish hands over the built map, which may then be shared between threads for lookups.
+// After a failed add the builder should be discarded with idmap_builder_abort.
+struct idmap_builder;
+
+struct idmap_pair {
+	uid_t from_user;
+	gid_t from_group;
+	uid_t to_user;
+	gid_t to_group;
+};
+
+struct idmap_builder* idmap_builder_new(size_t users_hint, size_t groups_hint, size_t pair_users_hint);
+bool idmap_builder_add_users(struct idmap_builder*, const uid_t (*users)[2], size_t count);
+bool idmap_builder_add_groups(struct idmap_builder*, const gid_t (*groups)[2], size_t count);
+bool idmap_builder_add_user_group_pairs(struct idmap_builder*, const struct idmap_pair* pairs, size_t count);
+struct idmap* idmap_builder_finish(struct idmap_builder*);
+void idmap_builder_abort(struct idmap_builder*);
 
-void idmap_map(struct idmap*, uid_t* restrict uid, gid_t* restrict gid, bool invert);
+void idmap_map(const struct idmap*, uid_t* restrict uid, gid_t* restrict gid, bool invert);
 
 #endif
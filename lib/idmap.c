@@ -6,73 +6,716 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
 #include <errno.h>
 #include "idmap.h"
 
+// IDs are looked up in open addressing tables with power of two capacities, kept at most half full.
+// The reserve functions make room for count entries in total.
+// Each direction of the mapping has its own set of tables.
+struct id_entry {
+	id_t from, to;
+	bool used;
+};
+
+struct id_table {
+	struct id_entry* entries;
+	size_t count, cap;
+};
+
+// User:group pair rules are indexed by user and then by group.
+// Wildcard rules map the wildcarded ID through pass, or leave it unchanged when pass is NULL.
+struct gid_rule {
+	id_t gid, to[2];
+	const struct id_table* pass;
+	bool used;
+};
+
+struct uid_rules {
+	id_t uid;
+	bool used, any_group;
+	id_t any_group_to;
+	const struct id_table* any_group_pass;
+	struct gid_rule* gids;
+	size_t ngids, gids_cap;
+};
+
+struct pair_index {
+	struct uid_rules* uids;
+	size_t nuids, uids_cap;
+	struct gid_rule* any_user;
+	size_t nany_user, any_user_cap;
+};
+
+struct idmap_dir {
+	struct id_table users, groups;
+	struct pair_index pairs;
+	// Tables referenced by the wildcard rules of composed maps
+	struct id_table** pass_tables;
+	size_t npass_tables;
+};
+
 struct idmap {
-	id_t (*uids) [2],
-	     (*gids) [2],
-	     (*ugids)[2][2];
-	size_t nuids, ngids, nugids;
+	struct idmap_dir dirs[2];
+	// Set while reading the stages of a chain, where mapping an ID twice is an error rather than first-wins
+	bool strict;
 };
 
-static inline bool add_id(id_t from_id, id_t to_id, id_t (**ids)[2], size_t* size) {
-	id_t (*newids)[2] = realloc(*ids, sizeof(**ids)*(*size+1));
-	if(!newids)
+static inline uint32_t id_mix(id_t id) {
+	uint32_t h = id;
+	h ^= h >> 16;
+	h *= UINT32_C(0x45d9f3b);
+	h ^= h >> 16;
+	return h;
+}
+
+static inline size_t id_hash(id_t id, size_t cap) {
+	return id_mix(id) & (cap-1);
+}
+
+// Each returns the index of the slot holding id, or of the empty slot it would be inserted into
+static size_t id_entry_slot(const struct id_entry* entries, size_t cap, id_t id) {
+	size_t i = id_hash(id, cap);
+	while(entries[i].used && entries[i].from != id)
+		i = (i+1) & (cap-1);
+	return i;
+}
+
+static size_t gid_rule_slot(const struct gid_rule* rules, size_t cap, id_t gid) {
+	size_t i = id_hash(gid, cap);
+	while(rules[i].used && rules[i].gid != gid)
+		i = (i+1) & (cap-1);
+	return i;
+}
+
+static size_t uid_rules_slot(const struct uid_rules* rules, size_t cap, id_t uid) {
+	size_t i = id_hash(uid, cap);
+	while(rules[i].used && rules[i].uid != uid)
+		i = (i+1) & (cap-1);
+	return i;
+}
+
+static inline const struct id_entry* find_id(const struct id_table* table, id_t id) {
+	if(!table->cap)
+		return NULL;
+	const struct id_entry* entry = table->entries + id_entry_slot(table->entries, table->cap, id);
+	return entry->used ? entry : NULL;
+}
+
+static inline id_t map_id(const struct id_table* table, id_t id) {
+	const struct id_entry* entry = table ? find_id(table, id) : NULL;
+	return entry ? entry->to : id;
+}
+
+static inline const struct gid_rule* find_gid_rule(const struct gid_rule* rules, size_t cap, id_t gid) {
+	if(!cap)
+		return NULL;
+	const struct gid_rule* rule = rules + gid_rule_slot(rules, cap, gid);
+	return rule->used ? rule : NULL;
+}
+
+static inline const struct uid_rules* find_uid_rules(const struct uid_rules* rules, size_t cap, id_t uid) {
+	if(!cap)
+		return NULL;
+	const struct uid_rules* rule = rules + uid_rules_slot(rules, cap, uid);
+	return rule->used ? rule : NULL;
+}
+
+static bool reserve_ids(struct id_entry** entries, size_t* cap, size_t count) {
+	if(count*2 <= *cap)
+		return true;
+	size_t newcap = *cap ? *cap*2 : 8;
+	while(newcap < count*2)
+		newcap *= 2;
+	struct id_entry* newentries = calloc(newcap, sizeof(*newentries));
+	if(!newentries)
+		return false;
+	for(size_t i = 0; i < *cap; i++)
+		if((*entries)[i].used)
+			newentries[id_entry_slot(newentries, newcap, (*entries)[i].from)] = (*entries)[i];
+	free(*entries);
+	*entries = newentries;
+	*cap = newcap;
+	return true;
+}
+
+// Every user with pair rules has a table of these, so they start small
+static bool reserve_gid_rules(struct gid_rule** rules, size_t* cap, size_t count) {
+	if(count*2 <= *cap)
+		return true;
+	size_t newcap = *cap ? *cap*2 : 2;
+	while(newcap < count*2)
+		newcap *= 2;
+	struct gid_rule* newrules = calloc(newcap, sizeof(*newrules));
+	if(!newrules)
+		return false;
+	for(size_t i = 0; i < *cap; i++)
+		if((*rules)[i].used)
+			newrules[gid_rule_slot(newrules, newcap, (*rules)[i].gid)] = (*rules)[i];
+	free(*rules);
+	*rules = newrules;
+	*cap = newcap;
+	return true;
+}
+
+static bool reserve_uid_rules(struct uid_rules** rules, size_t* cap, size_t count) {
+	if(count*2 <= *cap)
+		return true;
+	size_t newcap = *cap ? *cap*2 : 8;
+	while(newcap < count*2)
+		newcap *= 2;
+	struct uid_rules* newrules = calloc(newcap, sizeof(*newrules));
+	if(!newrules)
+		return false;
+	for(size_t i = 0; i < *cap; i++)
+		if((*rules)[i].used)
+			newrules[uid_rules_slot(newrules, newcap, (*rules)[i].uid)] = (*rules)[i];
+	free(*rules);
+	*rules = newrules;
+	*cap = newcap;
+	return true;
+}
+
+// The first mapping added for an ID wins. When strict, a later mapping of the same ID to a different target is a conflict.
+static inline bool check_conflict(bool strict, bool same) {
+	if(strict && !same) {
+		errno = EEXIST;
 		return false;
-	*ids = newids;
-	newids += *size;
-	(*newids)[0] = from_id;
-	(*newids)[1] = to_id;
-	(*size)++;
+	}
 	return true;
 }
 
+static inline bool table_reserve(struct id_table* table, size_t count) {
+	return reserve_ids(&table->entries, &table->cap, table->count+count);
+}
+
+static inline bool pair_index_reserve(struct pair_index* idx, size_t users) {
+	return reserve_uid_rules(&idx->uids, &idx->uids_cap, idx->nuids+users);
+}
+
+static bool table_add(struct id_table* table, id_t from, id_t to, bool strict) {
+	if(!reserve_ids(&table->entries, &table->cap, table->count+1))
+		return false;
+	struct id_entry* entry = table->entries + id_entry_slot(table->entries, table->cap, from);
+	if(entry->used)
+		return check_conflict(strict, entry->to == to);
+	*entry = (struct id_entry){ from, to, true };
+	table->count++;
+	return true;
+}
+
+static struct uid_rules* pair_index_user(struct pair_index* idx, id_t uid) {
+	if(!reserve_uid_rules(&idx->uids, &idx->uids_cap, idx->nuids+1))
+		return NULL;
+	struct uid_rules* rules = idx->uids + uid_rules_slot(idx->uids, idx->uids_cap, uid);
+	if(!rules->used) {
+		*rules = (struct uid_rules){ .uid = uid, .used = true };
+		idx->nuids++;
+	}
+	return rules;
+}
+
+static bool uid_rules_add(struct uid_rules* rules, id_t from_group, id_t to_user, id_t to_group, bool strict) {
+	if(!reserve_gid_rules(&rules->gids, &rules->gids_cap, rules->ngids+1))
+		return false;
+	struct gid_rule* rule = rules->gids + gid_rule_slot(rules->gids, rules->gids_cap, from_group);
+	if(rule->used)
+		return check_conflict(strict, rule->to[0] == to_user && rule->to[1] == to_group);
+	*rule = (struct gid_rule){ from_group, { to_user, to_group }, NULL, true };
+	rules->ngids++;
+	return true;
+}
+
+static bool pair_index_add(struct pair_index* idx, id_t from_user, id_t from_group, id_t to_user, id_t to_group, bool strict) {
+	struct uid_rules* rules = pair_index_user(idx, from_user);
+	return rules && uid_rules_add(rules, from_group, to_user, to_group, strict);
+}
+
+static bool pair_index_add_any_group(struct pair_index* idx, id_t from_user, id_t to_user, const struct id_table* pass, bool strict) {
+	struct uid_rules* rules = pair_index_user(idx, from_user);
+	if(!rules)
+		return false;
+	if(rules->any_group)
+		return check_conflict(strict, rules->any_group_to == to_user && rules->any_group_pass == pass);
+	rules->any_group = true;
+	rules->any_group_to = to_user;
+	rules->any_group_pass = pass;
+	return true;
+}
+
+static bool pair_index_add_any_user(struct pair_index* idx, id_t from_group, id_t to_group, const struct id_table* pass, bool strict) {
+	if(!reserve_gid_rules(&idx->any_user, &idx->any_user_cap, idx->nany_user+1))
+		return false;
+	struct gid_rule* rule = idx->any_user + gid_rule_slot(idx->any_user, idx->any_user_cap, from_group);
+	if(rule->used)
+		return check_conflict(strict, rule->to[1] == to_group && rule->pass == pass);
+	*rule = (struct gid_rule){ from_group, { 0, to_group }, pass, true };
+	idx->nany_user++;
+	return true;
+}
+
+static void dir_free(struct idmap_dir* dir) {
+	free(dir->users.entries);
+	free(dir->groups.entries);
+	for(size_t i = 0; i < dir->pairs.uids_cap; i++)
+		free(dir->pairs.uids[i].gids);
+	free(dir->pairs.uids);
+	free(dir->pairs.any_user);
+	for(size_t i = 0; i < dir->npass_tables; i++) {
+		free(dir->pass_tables[i]->entries);
+		free(dir->pass_tables[i]);
+	}
+	free(dir->pass_tables);
+}
+
+static void dir_map(const struct idmap_dir* dir, uid_t* restrict uid, gid_t* restrict gid) {
+	// Pair rules take priority in order of specificity: uid:gid, then uid:*, then *:gid.
+	// A matching wildcard rule passes the wildcarded ID through without consulting the individual maps.
+	const struct pair_index* pairs = &dir->pairs;
+	const struct uid_rules* user_rules = find_uid_rules(pairs->uids, pairs->uids_cap, *uid);
+	if(user_rules) {
+		const struct gid_rule* rule = find_gid_rule(user_rules->gids, user_rules->gids_cap, *gid);
+		if(rule) {
+			*uid = rule->to[0];
+			*gid = rule->to[1];
+			return;
+		}
+		if(user_rules->any_group) {
+			*uid = user_rules->any_group_to;
+			*gid = map_id(user_rules->any_group_pass, *gid);
+			return;
+		}
+	}
+	const struct gid_rule* group_rule = find_gid_rule(pairs->any_user, pairs->any_user_cap, *gid);
+	if(group_rule) {
+		*uid = map_id(group_rule->pass, *uid);
+		*gid = group_rule->to[1];
+		return;
+	}
+
+	*uid = map_id(&dir->users, *uid);
+	*gid = map_id(&dir->groups, *gid);
+}
+
+// Only the forward direction can be strict, since many foreign IDs may legitimately map to the same local ID
 bool idmap_add_user(struct idmap* map, uid_t from_user, uid_t to_user) {
-	return add_id(from_user, to_user, &map->uids, &map->nuids);
+	return table_add(&map->dirs[0].users, from_user, to_user, map->strict) &&
+	       table_add(&map->dirs[1].users, to_user, from_user, false);
 }
 
 bool idmap_add_group(struct idmap* map, gid_t from_group, gid_t to_group) {
-	return add_id(from_group, to_group, &map->gids, &map->ngids);
+	return table_add(&map->dirs[0].groups, from_group, to_group, map->strict) &&
+	       table_add(&map->dirs[1].groups, to_group, from_group, false);
 }
 
 bool idmap_add_user_group_pair(struct idmap* map, uid_t from_user, gid_t from_group, uid_t to_user, gid_t to_group) {
-	id_t (*ids)[2][2] = realloc(map->ugids, sizeof(*map->ugids)*(map->nugids+1));
-	if(!ids)
+	return pair_index_add(&map->dirs[0].pairs, from_user, from_group, to_user, to_group, map->strict) &&
+	       pair_index_add(&map->dirs[1].pairs, to_user, to_group, from_user, from_group, false);
+}
+
+bool idmap_add_user_any_group(struct idmap* map, uid_t from_user, uid_t to_user) {
+	return pair_index_add_any_group(&map->dirs[0].pairs, from_user, to_user, NULL, map->strict) &&
+	       pair_index_add_any_group(&map->dirs[1].pairs, to_user, from_user, NULL, false);
+}
+
+bool idmap_add_group_any_user(struct idmap* map, gid_t from_group, gid_t to_group) {
+	return pair_index_add_any_user(&map->dirs[0].pairs, from_group, to_group, NULL, map->strict) &&
+	       pair_index_add_any_user(&map->dirs[1].pairs, to_group, from_group, NULL, false);
+}
+
+/*
+ * Composition flattens "first, then second" into a single set of rules of the same shape.
+ * The individual maps and wildcard rules compose table by table, which is why wildcard rules carry a pass table.
+ * Everywhere this would disagree with applying both maps in turn, an exact pair rule is added holding the result
+ * of evaluating both maps. Those are the inputs that reach a pair rule of second, plus the combinations of user
+ * and group wildcards whose precedence differs between the two maps.
+ */
+
+// Preimages of IDs under first, as entries sorted by target
+struct preimages {
+	struct id_entry* entries;
+	size_t count, cap;
+};
+
+struct pass_cache {
+	const struct id_table* first,* second,* result;
+};
+
+// Exact rules that composition may derive from pair and wildcard rules, beyond those of first itself and
+// one for each exact rule of second.
+// A rule of second is repeated for every pair first turns into its key, which grows with the product of
+// the preimages of its user and group, so chains that would exceed this are refused with E2BIG instead.
+#define COMPOSE_MAX_EXCEPTIONS (1 << 20)
+
+struct compose_ctx {
+	const struct idmap_dir* first,* second;
+	struct idmap_dir* out;
+	// All preimages of user/group IDs, and those through the individual maps of first only
+	struct preimages users, groups, map_users, map_groups;
+	struct pass_cache* cache;
+	size_t ncache;
+	size_t exceptions, max_exceptions;
+};
+
+static bool preimages_add(struct preimages* pre, id_t from, id_t to) {
+	if(pre->count == pre->cap) {
+		size_t newcap = pre->cap ? pre->cap*2 : 16;
+		struct id_entry* entries = realloc(pre->entries, sizeof(*entries)*newcap);
+		if(!entries)
+			return false;
+		pre->entries = entries;
+		pre->cap = newcap;
+	}
+	pre->entries[pre->count++] = (struct id_entry){ from, to, true };
+	return true;
+}
+
+static bool preimages_add_table(struct preimages* pre, const struct id_table* table) {
+	for(size_t i = 0; i < table->cap; i++)
+		if(table->entries[i].used && !preimages_add(pre, table->entries[i].from, table->entries[i].to))
+			return false;
+	return true;
+}
+
+static int compare_targets(const void* a, const void* b) {
+	const struct id_entry* x = a,* y = b;
+	return (x->to > y->to) - (x->to < y->to);
+}
+
+// Returns the preimages of id, which doesn't include id itself
+static const struct id_entry* preimages_find(const struct preimages* pre, id_t id, size_t* count) {
+	size_t lo = 0, hi = pre->count;
+	while(lo < hi) {
+		size_t mid = lo + (hi-lo)/2;
+		if(pre->entries[mid].to < id)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	size_t end = lo;
+	while(end < pre->count && pre->entries[end].to == id)
+		end++;
+	*count = end-lo;
+	return pre->entries + lo;
+}
+
+static bool compose_build_preimages(struct compose_ctx* ctx) {
+	const struct idmap_dir* first = ctx->first;
+	if(!(preimages_add_table(&ctx->map_users, &first->users) && preimages_add_table(&ctx->map_groups, &first->groups) &&
+	     preimages_add_table(&ctx->users, &first->users) && preimages_add_table(&ctx->groups, &first->groups)))
+		return false;
+	// Pass tables are shared between rules, so these are included once for both users and groups
+	for(size_t i = 0; i < first->npass_tables; i++)
+		if(!(preimages_add_table(&ctx->users, first->pass_tables[i]) && preimages_add_table(&ctx->groups, first->pass_tables[i])))
+			return false;
+	for(size_t i = 0; i < first->pairs.uids_cap; i++) {
+		const struct uid_rules* rules = first->pairs.uids + i;
+		if(rules->used && rules->any_group && !preimages_add(&ctx->users, rules->uid, rules->any_group_to))
+			return false;
+	}
+	for(size_t i = 0; i < first->pairs.any_user_cap; i++) {
+		const struct gid_rule* rule = first->pairs.any_user + i;
+		if(rule->used && !preimages_add(&ctx->groups, rule->gid, rule->to[1]))
+			return false;
+	}
+
+	struct preimages* all[] = { &ctx->users, &ctx->groups, &ctx->map_users, &ctx->map_groups };
+	for(size_t i = 0; i < sizeof(all)/sizeof(*all); i++)
+		if(all[i]->count)
+			qsort(all[i]->entries, all[i]->count, sizeof(*all[i]->entries), compare_targets);
+	return true;
+}
+
+// A NULL table maps every ID to itself
+static bool compose_table(struct id_table* out, const struct id_table* first, const struct id_table* second) {
+	if(first)
+		for(size_t i = 0; i < first->cap; i++)
+			if(first->entries[i].used && !table_add(out, first->entries[i].from, map_id(second, first->entries[i].to), false))
+				return false;
+	// IDs already mapped by first are skipped by table_add
+	if(second)
+		for(size_t i = 0; i < second->cap; i++)
+			if(second->entries[i].used && !table_add(out, second->entries[i].from, second->entries[i].to, false))
+				return false;
+	return true;
+}
+
+static bool compose_pass(struct compose_ctx* ctx, const struct id_table* first, const struct id_table* second, const struct id_table** result) {
+	*result = NULL;
+	if(!first && !second)
+		return true;
+	for(size_t i = 0; i < ctx->ncache; i++)
+		if(ctx->cache[i].first == first && ctx->cache[i].second == second) {
+			*result = ctx->cache[i].result;
+			return true;
+		}
+
+	struct idmap_dir* out = ctx->out;
+	struct id_table** tables = realloc(out->pass_tables, sizeof(*tables)*(out->npass_tables+1));
+	if(!tables)
+		return false;
+	out->pass_tables = tables;
+	struct pass_cache* cache = realloc(ctx->cache, sizeof(*cache)*(ctx->ncache+1));
+	if(!cache)
+		return false;
+	ctx->cache = cache;
+	struct id_table* table = calloc(1, sizeof(*table));
+	if(!table)
+		return false;
+	out->pass_tables[out->npass_tables++] = table;
+	ctx->cache[ctx->ncache++] = (struct pass_cache){ first, second, table };
+
+	*result = table;
+	return compose_table(table, first, second);
+}
+
+// Adds an exact rule for user:group unless the tables and wildcard rules of out already give the same result.
+// Rules derived from those of second count towards the limit.
+static bool compose_exact(struct compose_ctx* ctx, id_t user, id_t group, bool derived) {
+	uid_t uid = user, out_uid = user;
+	gid_t gid = group, out_gid = group;
+	dir_map(ctx->first, &uid, &gid);
+	dir_map(ctx->second, &uid, &gid);
+	dir_map(ctx->out, &out_uid, &out_gid);
+	if(uid == out_uid && gid == out_gid)
+		return true;
+	if(derived && ++ctx->exceptions > ctx->max_exceptions) {
+		errno = E2BIG;
+		return false;
+	}
+	return pair_index_add(&ctx->out->pairs, user, group, uid, gid, false);
+}
+
+static bool compose_wildcards(struct compose_ctx* ctx) {
+	const struct idmap_dir* first = ctx->first,* second = ctx->second;
+	struct pair_index* out = &ctx->out->pairs;
+	const struct id_table* pass;
+
+	// uid:* rules of first, followed by whatever second does with the resulting user
+	for(size_t i = 0; i < first->pairs.uids_cap; i++) {
+		const struct uid_rules* rules = first->pairs.uids + i;
+		if(!(rules->used && rules->any_group))
+			continue;
+		const struct uid_rules* next = find_uid_rules(second->pairs.uids, second->pairs.uids_cap, rules->any_group_to);
+		if(next && next->any_group) {
+			if(!(compose_pass(ctx, rules->any_group_pass, next->any_group_pass, &pass) &&
+			     pair_index_add_any_group(out, rules->uid, next->any_group_to, pass, false)))
+				return false;
+		}
+		else if(!(compose_pass(ctx, rules->any_group_pass, &second->groups, &pass) &&
+		          pair_index_add_any_group(out, rules->uid, map_id(&second->users, rules->any_group_to), pass, false)))
+			return false;
+	}
+	// uid:* rules of second, reached through the user map of first. Users with uid:* rules in first were added above.
+	for(size_t i = 0; i < second->pairs.uids_cap; i++) {
+		const struct uid_rules* rules = second->pairs.uids + i;
+		if(!(rules->used && rules->any_group))
+			continue;
+		if(!compose_pass(ctx, &first->groups, rules->any_group_pass, &pass))
+			return false;
+		size_t n;
+		const struct id_entry* pre = preimages_find(&ctx->map_users, rules->uid, &n);
+		for(size_t j = 0; j < n; j++)
+			if(!pair_index_add_any_group(out, pre[j].from, rules->any_group_to, pass, false))
+				return false;
+		if(!find_id(&first->users, rules->uid) && !pair_index_add_any_group(out, rules->uid, rules->any_group_to, pass, false))
+			return false;
+	}
+
+	// Likewise for *:gid rules
+	for(size_t i = 0; i < first->pairs.any_user_cap; i++) {
+		const struct gid_rule* rule = first->pairs.any_user + i;
+		if(!rule->used)
+			continue;
+		const struct gid_rule* next = find_gid_rule(second->pairs.any_user, second->pairs.any_user_cap, rule->to[1]);
+		if(next) {
+			if(!(compose_pass(ctx, rule->pass, next->pass, &pass) &&
+			     pair_index_add_any_user(out, rule->gid, next->to[1], pass, false)))
+				return false;
+		}
+		else if(!(compose_pass(ctx, rule->pass, &second->users, &pass) &&
+		          pair_index_add_any_user(out, rule->gid, map_id(&second->groups, rule->to[1]), pass, false)))
+			return false;
+	}
+	for(size_t i = 0; i < second->pairs.any_user_cap; i++) {
+		const struct gid_rule* rule = second->pairs.any_user + i;
+		if(!rule->used)
+			continue;
+		if(!compose_pass(ctx, &first->users, rule->pass, &pass))
+			return false;
+		size_t n;
+		const struct id_entry* pre = preimages_find(&ctx->map_groups, rule->gid, &n);
+		for(size_t j = 0; j < n; j++)
+			if(!pair_index_add_any_user(out, pre[j].from, rule->to[1], pass, false))
+				return false;
+		if(!find_id(&first->groups, rule->gid) && !pair_index_add_any_user(out, rule->gid, rule->to[1], pass, false))
+			return false;
+	}
+	return true;
+}
+
+// Adds exact rules for every user and group that first may turn into user and group respectively
+static bool compose_exact_preimages(struct compose_ctx* ctx, id_t user, id_t group) {
+	size_t nusers, ngroups;
+	const struct id_entry* users = preimages_find(&ctx->users, user, &nusers);
+	const struct id_entry* groups = preimages_find(&ctx->groups, group, &ngroups);
+	for(size_t i = 0; i <= nusers; i++)
+		for(size_t j = 0; j <= ngroups; j++)
+			if(!compose_exact(ctx, i < nusers ? users[i].from : user, j < ngroups ? groups[j].from : group, true))
+				return false;
+	return true;
+}
+
+static bool compose_exceptions(struct compose_ctx* ctx) {
+	const struct idmap_dir* first = ctx->first,* second = ctx->second;
+	size_t n;
+	const struct id_entry* pre;
+
+	for(size_t i = 0; i < first->pairs.uids_cap; i++) {
+		const struct uid_rules* rules = first->pairs.uids + i;
+		for(size_t j = 0; rules->used && j < rules->gids_cap; j++)
+			if(rules->gids[j].used && !compose_exact(ctx, rules->uid, rules->gids[j].gid, false))
+				return false;
+	}
+	ctx->max_exceptions = COMPOSE_MAX_EXCEPTIONS;
+	for(size_t i = 0; i < second->pairs.uids_cap; i++)
+		if(second->pairs.uids[i].used)
+			ctx->max_exceptions += second->pairs.uids[i].ngids;
+	for(size_t i = 0; i < second->pairs.uids_cap; i++) {
+		const struct uid_rules* rules = second->pairs.uids + i;
+		if(!rules->used)
+			continue;
+		for(size_t j = 0; j < rules->gids_cap; j++)
+			if(rules->gids[j].used && !compose_exact_preimages(ctx, rules->uid, rules->gids[j].gid))
+				return false;
+		if(!rules->any_group)
+			continue;
+		// A uid:* rule of second beats the *:gid rules of first
+		pre = preimages_find(&ctx->users, rules->uid, &n);
+		for(size_t j = 0; j <= n; j++)
+			for(size_t k = 0; k < first->pairs.any_user_cap; k++)
+				if(first->pairs.any_user[k].used && !compose_exact(ctx, j < n ? pre[j].from : rules->uid, first->pairs.any_user[k].gid, true))
+					return false;
+	}
+	// And the uid:* rules of first beat the *:gid rules of second
+	for(size_t i = 0; i < second->pairs.any_user_cap; i++) {
+		const struct gid_rule* rule = second->pairs.any_user + i;
+		if(!rule->used)
+			continue;
+		pre = preimages_find(&ctx->groups, rule->gid, &n);
+		for(size_t j = 0; j <= n; j++)
+			for(size_t k = 0; k < first->pairs.uids_cap; k++)
+				if(first->pairs.uids[k].used && first->pairs.uids[k].any_group &&
+				   !compose_exact(ctx, first->pairs.uids[k].uid, j < n ? pre[j].from : rule->gid, true))
+					return false;
+	}
+	// uid:* rules of out also beat its *:gid rules, but for that to differ from the chained result
+	// either first or second must have preferred a *:gid rule, and those pairs are covered above
+	return true;
+}
+
+static bool compose_dir(struct idmap_dir* out, const struct idmap_dir* first, const struct idmap_dir* second) {
+	struct compose_ctx ctx = { .first = first, .second = second, .out = out };
+	bool ok = compose_build_preimages(&ctx) &&
+	          compose_table(&out->users, &first->users, &second->users) &&
+	          compose_table(&out->groups, &first->groups, &second->groups) &&
+	          compose_wildcards(&ctx) &&
+	          compose_exceptions(&ctx);
+	free(ctx.users.entries);
+	free(ctx.groups.entries);
+	free(ctx.map_users.entries);
+	free(ctx.map_groups.entries);
+	free(ctx.cache);
+	return ok;
+}
+
+bool idmap_compose(struct idmap* map, const struct idmap* next) {
+	struct idmap_dir dirs[2] = {{{0}}};
+	if(!(compose_dir(&dirs[0], &map->dirs[0], &next->dirs[0]) && compose_dir(&dirs[1], &next->dirs[1], &map->dirs[1]))) {
+		dir_free(&dirs[0]);
+		dir_free(&dirs[1]);
 		return false;
-	map->ugids = ids;
-	ids += map->nugids;
-	(*ids)[0][0] = from_user;
-	(*ids)[0][1] = from_group;
-	(*ids)[1][0] = to_user;
-	(*ids)[1][1] = to_group;
-	map->nugids++;
+	}
+	dir_free(&map->dirs[0]);
+	dir_free(&map->dirs[1]);
+	map->dirs[0] = dirs[0];
+	map->dirs[1] = dirs[1];
 	return true;
 }
 
-static inline bool read_ids(FILE* f, id_t (**ids)[2], size_t* size) {
+static inline bool read_ids(FILE* f, struct idmap* map, bool users) {
 	// No format specifier for id_t, so scan these separately as %u
 	unsigned int from_id, to_id;
 	while(fscanf(f, "%u %u\n", &from_id, &to_id) == 2)
-		if(!add_id(from_id, to_id, ids, size))
+		if(!(users ? idmap_add_user(map, from_id, to_id) : idmap_add_group(map, from_id, to_id)))
 			return false;
 	return feof(f);
 }
 
 bool idmap_read_users(struct idmap* map, FILE* mapfile) {
-	return read_ids(mapfile, &map->uids, &map->nuids);
+	return read_ids(mapfile, map, true);
 }
 
 bool idmap_read_groups(struct idmap* map, FILE* mapfile) {
-	return read_ids(mapfile, &map->gids, &map->ngids);
+	return read_ids(mapfile, map, false);
+}
+
+// Parses one side of a pair rule, "uid:gid" where either ID may be the wildcard "*"
+static bool parse_pair(const char* str, unsigned int ids[2], bool any[2]) {
+	for(int i = 0; i < 2; i++) {
+		if(i && *str++ != ':')
+			goto err;
+		if((any[i] = *str == '*')) {
+			str++;
+			continue;
+		}
+		char* end;
+		errno = 0;
+		unsigned long id = strtoul(str, &end, 10);
+		if(end == str || errno || id > UINT_MAX)
+			goto err;
+		ids[i] = id;
+		str = end;
+	}
+	if(!*str)
+		return true;
+
+err:
+	errno = EINVAL;
+	return false;
 }
 
 bool idmap_read_user_group_pairs(struct idmap* map, FILE* mapfile) {
-	unsigned int from_user, from_group, to_user, to_group;
-	while(fscanf(mapfile, "%u:%u %u:%u\n", &from_user, &from_group, &to_user, &to_group) == 4)
-		if(!idmap_add_user_group_pair(map, from_user, from_group, to_user, to_group))
+	char from[32], to[32];
+	while(fscanf(mapfile, "%31s %31s\n", from, to) == 2) {
+		unsigned int from_ids[2], to_ids[2];
+		bool from_any[2], to_any[2];
+		if(!(parse_pair(from, from_ids, from_any) && parse_pair(to, to_ids, to_any)))
+			return false;
+		// Wildcards must appear on the same side of both pairs, and can't stand in for both IDs
+		if(from_any[0] != to_any[0] || from_any[1] != to_any[1] || (from_any[0] && from_any[1])) {
+			errno = EINVAL;
 			return false;
-	return feof(mapfile);
+		}
+
+		bool ok;
+		if(from_any[1])
+			ok = idmap_add_user_any_group(map, from_ids[0], to_ids[0]);
+		else if(from_any[0])
+			ok = idmap_add_group_any_user(map, from_ids[1], to_ids[1]);
+		else
+			ok = idmap_add_user_group_pair(map, from_ids[0], from_ids[1], to_ids[0], to_ids[1]);
+		if(!ok)
+			return false;
+	}
+	if(feof(mapfile))
+		return true;
+	// Stopped short of the end on a line that isn't a pair of pairs, unless reading failed
+	if(!ferror(mapfile))
+		errno = EINVAL;
+	return false;
 }
 
 bool idmap_read_mapfiles(struct idmap* map, const char* user_map, const char* group_map, const char* user_group_map) {
@@ -100,14 +743,33 @@ err:
 	return false;
 }
 
+// A single set of map files is read as usual. When chained, a stage mapping an ID twice can't be composed
+// with any certainty of what was meant, so conflicting mappings within a stage are reported instead.
+bool idmap_read_mapfile_chain(struct idmap* map, const struct idmap_mapfiles* chain, size_t count) {
+	bool strict = map->strict;
+	map->strict = strict || count > 1;
+	bool ok = !count || idmap_read_mapfiles(map, chain[0].user_map, chain[0].group_map, chain[0].user_group_map);
+	map->strict = strict;
+	for(size_t i = 1; ok && i < count; i++) {
+		struct idmap* next = idmap_open();
+		if(!next)
+			return false;
+		next->strict = true;
+		ok = idmap_read_mapfiles(next, chain[i].user_map, chain[i].group_map, chain[i].user_group_map) && idmap_compose(map, next);
+		int err = errno;
+		idmap_close(next);
+		errno = err;
+	}
+	return ok;
+}
+
 struct idmap* idmap_open(void) {
 	return calloc(1, sizeof(struct idmap));
 }
 
 void idmap_close(struct idmap* map) {
-	free(map->uids);
-	free(map->gids);
-	free(map->ugids);
+	dir_free(&map->dirs[0]);
+	dir_free(&map->dirs[1]);
 	free(map);
 }
 
@@ -121,21 +783,185 @@ struct idmap* idmap_open_with_mapfiles(const char* user_map, const char* group_m
 	return NULL;
 }
 
-void idmap_map(struct idmap* map, uid_t* restrict uid, gid_t* restrict gid, bool invert) {
-	for(int i = 0; i < map->nugids; i++)
-		if(map->ugids[i][!!invert][0] == *uid && map->ugids[i][!!invert][1] == *gid) {
-			*uid = map->ugids[i][!invert][0];
-			*gid = map->ugids[i][!invert][1];
-			return;
-		}
-	for(int i = 0; i < map->nuids; i++)
-		if(map->uids[i][!!invert] == *uid) {
-			*uid = map->uids[i][!invert];
-			break;
-		}
-	for(int i = 0; i < map->ngids; i++)
-		if(map->gids[i][!!invert] == *gid) {
-			*gid = map->gids[i][!invert];
-			break;
+struct idmap* idmap_open_with_mapfile_chain(const struct idmap_mapfiles* chain, size_t count) {
+	struct idmap* map = idmap_open();
+	if(!map)
+		return NULL;
+	if(idmap_read_mapfile_chain(map, chain, count))
+		return map;
+	idmap_close(map);
+	return NULL;
+}
+
+#define RADIX_BITS 11
+
+struct idmap_builder {
+	struct idmap* map;
+	// Two buffers for sorting batches into, kept between batches and grown to the largest
+	char* scratch[2];
+	size_t scratch_size;
+	size_t offsets[(1 << RADIX_BITS)+1];
+};
+
+struct idmap_builder* idmap_builder_new(size_t users_hint, size_t groups_hint, size_t pair_users_hint) {
+	struct idmap_builder* builder = calloc(1, sizeof(*builder));
+	if(!builder)
+		return NULL;
+	if(!(builder->map = idmap_open()))
+		goto err;
+	for(int i = 0; i < 2; i++)
+		if(!(table_reserve(&builder->map->dirs[i].users, users_hint) &&
+		     table_reserve(&builder->map->dirs[i].groups, groups_hint) &&
+		     pair_index_reserve(&builder->map->dirs[i].pairs, pair_users_hint)))
+			goto err;
+	return builder;
+
+err:
+	idmap_builder_abort(builder);
+	return NULL;
+}
+
+// Makes room for a batch in each scratch buffer. Batches that don't fit are inserted unsorted.
+static void builder_scratch(struct idmap_builder* builder, size_t count, size_t size) {
+	if(count < 1 << RADIX_BITS || size*count <= builder->scratch_size)
+		return;
+	for(int i = 0; i < 2; i++) {
+		free(builder->scratch[i]);
+		builder->scratch[i] = NULL;
+	}
+	builder->scratch_size = 0;
+	if((builder->scratch[0] = malloc(size*count)) && (builder->scratch[1] = malloc(size*count)))
+		builder->scratch_size = size*count;
+}
+
+// Large batches are sorted by the hashes of their IDs before inserting. Sorting by the upper bits of the
+// home slot lets a batch sweep over a table in sequence rather than at random, and sorting by the whole
+// hash brings together every entry for the same ID. This is an LSD radix sort over the bits of the hash
+// selected by mask, and is stable so that the first of several entries for the same ID still wins.
+// Passes alternate between the scratch buffers starting with scratch[out], so items may be in the other
+// buffer, or in out itself when mask takes more than one pass, as a region mask never does.
+// Returns NULL when the batch is too small to benefit or doesn't fit in the scratch buffers.
+static const void* order_by_hash(struct idmap_builder* builder, const void* items, size_t count, size_t size, id_t (*key)(const void*), uint32_t mask, int out) {
+	if(count < 1 << RADIX_BITS || !mask || size*count > builder->scratch_size)
+		return NULL;
+	int shift = 0;
+	while(!(mask >> shift & 1))
+		shift++;
+
+	size_t* offsets = builder->offsets;
+	const char* src = items;
+	for(; shift < 32 && mask >> shift; shift += RADIX_BITS, out ^= 1) {
+		for(size_t i = 0; i <= 1 << RADIX_BITS; i++)
+			offsets[i] = 0;
+		for(size_t i = 0; i < count; i++)
+			offsets[((id_mix(key(src+i*size)) & mask) >> shift & ((1 << RADIX_BITS)-1))+1]++;
+		for(size_t i = 1; i <= 1 << RADIX_BITS; i++)
+			offsets[i] += offsets[i-1];
+		for(size_t i = 0; i < count; i++)
+			memcpy(builder->scratch[out] + size*offsets[(id_mix(key(src+i*size)) & mask) >> shift & ((1 << RADIX_BITS)-1)]++, src+i*size, size);
+		src = builder->scratch[out];
+	}
+	return src;
+}
+
+// Selects the upper bits of the home slot in a table of the given capacity
+static inline uint32_t region_mask(size_t cap) {
+	return cap > 1 << RADIX_BITS ? (cap-1) & ~((cap >> RADIX_BITS)-1) : 0;
+}
+
+static id_t user_from(const void* ids) { return (*(const uid_t(*)[2])ids)[0]; }
+static id_t user_to(const void* ids) { return (*(const uid_t(*)[2])ids)[1]; }
+static id_t group_from(const void* ids) { return (*(const gid_t(*)[2])ids)[0]; }
+static id_t group_to(const void* ids) { return (*(const gid_t(*)[2])ids)[1]; }
+static id_t pair_from_user(const void* pair) { return ((const struct idmap_pair*)pair)->from_user; }
+static id_t pair_from_group(const void* pair) { return ((const struct idmap_pair*)pair)->from_group; }
+static id_t pair_to_user(const void* pair) { return ((const struct idmap_pair*)pair)->to_user; }
+static id_t pair_to_group(const void* pair) { return ((const struct idmap_pair*)pair)->to_group; }
+
+static bool table_add_batch(struct idmap_builder* builder, struct id_table* table, const void* items, size_t count, size_t size, id_t (*from)(const void*), id_t (*to)(const void*), bool strict) {
+	if(!table_reserve(table, count))
+		return false;
+	builder_scratch(builder, count, size);
+	const char* sorted = order_by_hash(builder, items, count, size, from, region_mask(table->cap), 0);
+	const char* src = sorted ? sorted : items;
+	bool ok = true;
+	for(size_t i = 0; ok && i < count; i++)
+		ok = table_add(table, from(src+i*size), to(src+i*size), strict);
+	return ok;
+}
+
+// As with idmap_add_user and friends, only the forward direction can be strict
+bool idmap_builder_add_users(struct idmap_builder* builder, const uid_t (*users)[2], size_t count) {
+	struct idmap* map = builder->map;
+	return table_add_batch(builder, &map->dirs[0].users, users, count, sizeof(*users), user_from, user_to, map->strict) &&
+	       table_add_batch(builder, &map->dirs[1].users, users, count, sizeof(*users), user_to, user_from, false);
+}
+
+bool idmap_builder_add_groups(struct idmap_builder* builder, const gid_t (*groups)[2], size_t count) {
+	struct idmap* map = builder->map;
+	return table_add_batch(builder, &map->dirs[0].groups, groups, count, sizeof(*groups), group_from, group_to, map->strict) &&
+	       table_add_batch(builder, &map->dirs[1].groups, groups, count, sizeof(*groups), group_to, group_from, false);
+}
+
+// Pairs are sorted by user so that the index of users and each user's table of groups can be sized once.
+// Once the size of the index is known they are sorted again by region of the index, keeping each user's pairs together.
+bool idmap_builder_add_user_group_pairs(struct idmap_builder* builder, const struct idmap_pair* pairs, size_t count) {
+	builder_scratch(builder, count, sizeof(*pairs));
+	for(int dir = 0; dir < 2; dir++) {
+		id_t (*user)(const void*) = dir ? pair_to_user : pair_from_user;
+		const struct idmap_pair* by_user = order_by_hash(builder, pairs, count, sizeof(*pairs), user, UINT32_MAX, 0);
+		const struct idmap_pair* src = by_user ? by_user : pairs;
+		struct pair_index* idx = &builder->map->dirs[dir].pairs;
+
+		size_t nusers = 0;
+		for(size_t i = 0; i < count; i++)
+			nusers += !i || user(src+i) != user(src+i-1);
+		bool ok = pair_index_reserve(idx, nusers);
+		// Each sort goes into the scratch buffer that src isn't in
+		const struct idmap_pair* by_region = ok ? order_by_hash(builder, src, count, sizeof(*pairs), user, region_mask(idx->uids_cap), (const void*)src == builder->scratch[0]) : NULL;
+		if(by_region)
+			src = by_region;
+
+		for(size_t i = 0; ok && i < count;) {
+			size_t end = i+1;
+			while(end < count && user(src+end) == user(src+i))
+				end++;
+			struct uid_rules* rules = pair_index_user(idx, user(src+i));
+			if(!(ok = rules && reserve_gid_rules(&rules->gids, &rules->gids_cap, rules->ngids + end-i)))
+				break;
+			// Users with many groups get the same treatment for their table of groups
+			const struct idmap_pair* by_group = order_by_hash(builder, src+i, end-i, sizeof(*pairs), dir ? pair_to_group : pair_from_group,
+			                                                  region_mask(rules->gids_cap), (const void*)src == builder->scratch[0]);
+			const struct idmap_pair* run = by_group ? by_group : src+i;
+			for(size_t j = 0; ok && j < end-i; j++)
+				ok = dir ? uid_rules_add(rules, run[j].to_group, run[j].from_user, run[j].from_group, false)
+				         : uid_rules_add(rules, run[j].from_group, run[j].to_user, run[j].to_group, builder->map->strict);
+			i = end;
 		}
+		if(!ok)
+			return false;
+	}
+	return true;
+}
+
+struct idmap* idmap_builder_finish(struct idmap_builder* builder) {
+	struct idmap* map = builder->map;
+	free(builder->scratch[0]);
+	free(builder->scratch[1]);
+	free(builder);
+	return map;
+}
+
+void idmap_builder_abort(struct idmap_builder* builder) {
+	if(!builder)
+		return;
+	if(builder->map)
+		idmap_close(builder->map);
+	free(builder->scratch[0]);
+	free(builder->scratch[1]);
+	free(builder);
+}
+
+void idmap_map(const struct idmap* map, uid_t* restrict uid, gid_t* restrict gid, bool invert) {
+	dir_map(&map->dirs[!!invert], uid, gid);
 }
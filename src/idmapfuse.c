@@ -9,6 +9,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <errno.h>
 #if FUSE_USE_VERSION < 30
 #include <fuse.h>
@@ -23,13 +24,21 @@
 #endif
 
 #include "idmap.h"
+#include "idmaptrace.h"
 
 struct idmapfuse {
 	struct fuse_fs* next;
 	struct idmap* map;
+	struct idmaptrace* trace;
 	bool invert;
 };
 
+static inline void idmapfuse_map(struct idmapfuse* ctx, enum idmaptrace_op op, uid_t* restrict uid, gid_t* restrict gid, bool invert) {
+	if(ctx->trace)
+		idmaptrace_record(ctx->trace, op, *uid, *gid, invert);
+	idmap_map(ctx->map, uid, gid, invert);
+}
+
 #if FUSE_DARWIN_ENABLE_EXTENSIONS
 typedef struct fuse_darwin_attr stat_type;
 typedef fuse_darwin_fill_dir_t fill_dir_type;
@@ -46,14 +55,16 @@ typedef fuse_fill_dir_t fill_dir_type;
 static int idmapfuse_getattr(const char* path, struct stat* buf) {
 	struct idmapfuse* ctx = fuse_get_context()->private_data;
 	int ret = fuse_fs_getattr(ctx->next, path, buf);
-	idmap_map(ctx->map, &buf->st_uid, &buf->st_gid, ctx->invert);
+	if(!ret)
+		idmapfuse_map(ctx, IDMAPTRACE_GETATTR, &buf->st_uid, &buf->st_gid, ctx->invert);
 	return ret;
 }
 #else
 static int idmapfuse_getattr(const char* path, stat_type* buf, struct fuse_file_info *fi) {
 	struct idmapfuse* ctx = fuse_get_context()->private_data;
 	int ret = fuse_fs_getattr(ctx->next, path, buf, fi);
-	idmap_map(ctx->map, &stat_type_uid(buf), &stat_type_gid(buf), ctx->invert);
+	if(!ret)
+		idmapfuse_map(ctx, IDMAPTRACE_GETATTR, &stat_type_uid(buf), &stat_type_gid(buf), ctx->invert);
 	return ret;
 }
 #endif
@@ -62,7 +73,8 @@ static int idmapfuse_getattr(const char* path, stat_type* buf, struct fuse_file_
 static int idmapfuse_fgetattr(const char* path, stat_type* buf, struct fuse_file_info* fi) {
 	struct idmapfuse* ctx = fuse_get_context()->private_data;
 	int ret = fuse_fs_fgetattr(ctx->next, path, buf, fi);
-	idmap_map(ctx->map, &stat_type_uid(buf), &stat_type_gid(buf), ctx->invert);
+	if(!ret)
+		idmapfuse_map(ctx, IDMAPTRACE_FGETATTR, &stat_type_uid(buf), &stat_type_gid(buf), ctx->invert);
 	return ret;
 }
 #endif
@@ -71,7 +83,8 @@ static int idmapfuse_fgetattr(const char* path, stat_type* buf, struct fuse_file
 static int idmapfuse_statx(const char* path, int flags, int mask, struct statx* stx, struct fuse_file_info* fi) {
 	struct idmapfuse* ctx = fuse_get_context()->private_data;
 	int ret = fuse_fs_statx(ctx->next, path, flags, mask, stx, fi);
-	idmap_map(ctx->map, &stx->stx_uid, &stx->stx_gid, ctx->invert);
+	if(!ret)
+		idmapfuse_map(ctx, IDMAPTRACE_STATX, &stx->stx_uid, &stx->stx_gid, ctx->invert);
 	return ret;
 }
 #endif
@@ -86,7 +99,7 @@ struct intercept_filler {
 static int idmapfuse_filler(void* buf, const char* name, const stat_type* stbuf, off_t off, enum fuse_fill_dir_flags flags) {
 	struct intercept_filler* intercept_buf = buf;
 	if(flags & FUSE_FILL_DIR_PLUS)
-		idmap_map(intercept_buf->ctx->map, (uid_t*)&stat_type_uid(stbuf), (gid_t*)&stat_type_gid(stbuf), intercept_buf->ctx->invert);
+		idmapfuse_map(intercept_buf->ctx, IDMAPTRACE_READDIR, (uid_t*)&stat_type_uid(stbuf), (gid_t*)&stat_type_gid(stbuf), intercept_buf->ctx->invert);
 
 	return intercept_buf->original_filler(intercept_buf->original_buf, name, stbuf, off, flags);
 }
@@ -108,13 +121,13 @@ static int idmapfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler
 #if FUSE_VERSION < 30
 static int idmapfuse_chown(const char* path, uid_t uid, gid_t gid) {
 	struct idmapfuse* ctx = fuse_get_context()->private_data;
-	idmap_map(ctx->map, &uid, &gid, !ctx->invert);
+	idmapfuse_map(ctx, IDMAPTRACE_CHOWN, &uid, &gid, !ctx->invert);
 	return fuse_fs_chown(ctx->next, path, uid, gid);
 }
 #else
 static int idmapfuse_chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi) {
 	struct idmapfuse* ctx = fuse_get_context()->private_data;
-	idmap_map(ctx->map, &uid, &gid, !ctx->invert);
+	idmapfuse_map(ctx, IDMAPTRACE_CHOWN, &uid, &gid, !ctx->invert);
 	return fuse_fs_chown(ctx->next, path, uid, gid, fi);
 }
 #endif
@@ -123,6 +136,7 @@ static void idmapfuse_destroy(void* opaque) {
 	struct idmapfuse* ctx = opaque;
 	fuse_fs_destroy(ctx->next);
 	idmap_close(ctx->map);
+	idmaptrace_close(ctx->trace);
 	free(ctx);
 }
 
@@ -207,49 +221,123 @@ static const struct fuse_operations idmapfuse_ops = {
 };
 
 struct idmapfuse_opts {
-	const char* umap,* gmap,* ugmap;
+	struct idmap_mapfiles* chain;
+	size_t nchain;
+	const char* trace;
 	int invert;
+	bool nomem;
+};
+
+enum {
+	KEY_HELP,
+	KEY_UMAP,
+	KEY_GMAP,
+	KEY_PAIRMAP,
+	KEY_THEN,
 };
+
 static const struct fuse_opt idmapfuse_opts[] = {
-	FUSE_OPT_KEY("-h",    0),
-	FUSE_OPT_KEY("--help",0),
-	{"umap=%s",   offsetof(struct idmapfuse_opts,umap),  0},
-	{"gmap=%s",   offsetof(struct idmapfuse_opts,gmap),  0},
-	{"pairmap=%s",offsetof(struct idmapfuse_opts,ugmap), 0},
+	FUSE_OPT_KEY("-h",       KEY_HELP),
+	FUSE_OPT_KEY("--help",   KEY_HELP),
+	FUSE_OPT_KEY("umap=",    KEY_UMAP),
+	FUSE_OPT_KEY("gmap=",    KEY_GMAP),
+	FUSE_OPT_KEY("pairmap=", KEY_PAIRMAP),
+	FUSE_OPT_KEY("then",     KEY_THEN),
+	{"trace=%s",  offsetof(struct idmapfuse_opts,trace), 0},
 	{"invert",    offsetof(struct idmapfuse_opts,invert),1},
 	FUSE_OPT_END
 };
 
+// Map file options fill in the last stage of the chain, and "then" starts a new one
+static bool idmapfuse_add_stage(struct idmapfuse_opts* opts) {
+	struct idmap_mapfiles* chain = realloc(opts->chain, sizeof(*chain)*(opts->nchain+1));
+	if(!chain)
+		return false;
+	opts->chain = chain;
+	opts->chain[opts->nchain++] = (struct idmap_mapfiles){0};
+	return true;
+}
+
 static int idmapfuse_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs) {
-	if(key)
-		return 1;
+	struct idmapfuse_opts* opts = data;
+	const char** path;
+	switch(key) {
+		case KEY_HELP:
+			fprintf(
+				stderr,
+				"    -o umap=user.map       Path to UID remapping file\n"
+				"    -o gmap=group.map      Path to GID remapping file\n"
+				"    -o pairmap=pairs.map   Path to remapping file for specific user:group pairs\n"
+				"    -o then                apply the following maps to the result of the preceding ones\n"
+				"    -o invert              invert the mapping\n"
+				"    -o trace=idmap.trace   Record each mapping performed to a trace file for idmap-replay\n"
+			);
+			return -1;
+		case KEY_THEN:
+			if(!idmapfuse_add_stage(opts))
+				opts->nomem = true;
+			return 0;
+		case KEY_UMAP:
+		case KEY_GMAP:
+		case KEY_PAIRMAP:
+			if(!opts->nchain && !idmapfuse_add_stage(opts)) {
+				opts->nomem = true;
+				return 0;
+			}
+			path = key == KEY_UMAP ? &opts->chain[opts->nchain-1].user_map :
+			       key == KEY_GMAP ? &opts->chain[opts->nchain-1].group_map :
+			                         &opts->chain[opts->nchain-1].user_group_map;
+			free((char*)*path);
+			*path = strdup(strchr(arg, '=')+1);
+			if(!*path)
+				opts->nomem = true;
+			return 0;
+	}
+	return 1;
+}
 
-	fprintf(
-		stderr,
-		"    -o umap=user.map       Path to UID remapping file\n"
-		"    -o gmap=group.map      Path to GID remapping file\n"
-		"    -o pairmap=pairs.map   Path to remapping file for specific user:group pairs\n"
-		"    -o invert              invert the mapping\n"
-	);
-	return -1;
+static void idmapfuse_free_opts(struct idmapfuse_opts* opts) {
+	for(size_t i = 0; i < opts->nchain; i++) {
+		free((char*)opts->chain[i].user_map);
+		free((char*)opts->chain[i].group_map);
+		free((char*)opts->chain[i].user_group_map);
+	}
+	free(opts->chain);
+	free((char*)opts->trace);
 }
 
 static struct fuse_fs* idmapfuse_new(struct fuse_args* args, struct fuse_fs* next[]) {
 	struct idmapfuse_opts opts = {0};
-	if(fuse_opt_parse(args, &opts, idmapfuse_opts, idmapfuse_opt_proc) < 0)
+	if(fuse_opt_parse(args, &opts, idmapfuse_opts, idmapfuse_opt_proc) < 0 || opts.nomem) {
+		idmapfuse_free_opts(&opts);
 		return NULL;
+	}
 
 	struct idmapfuse* ctx = malloc(sizeof(*ctx));
-	ctx->next = next[0];
-	if(!(ctx->map = idmap_open_with_mapfiles(opts.umap, opts.gmap, opts.ugmap)))
+	if(!ctx || !(ctx->map = idmap_open_with_mapfile_chain(opts.chain, opts.nchain))) {
 		perror("Error initializing idmap");
+		idmapfuse_free_opts(&opts);
+		free(ctx);
+		return NULL;
+	}
+	ctx->next = next[0];
 	ctx->invert = opts.invert;
+	ctx->trace = NULL;
+	if(opts.trace && !(ctx->trace = idmaptrace_open(opts.trace))) {
+		perror("Error opening idmap trace");
+		idmapfuse_free_opts(&opts);
+		idmap_close(ctx->map);
+		free(ctx);
+		return NULL;
+	}
+	idmapfuse_free_opts(&opts);
 
 	struct fuse_fs* fs = fuse_fs_new(&idmapfuse_ops, sizeof(idmapfuse_ops), ctx);
 	if(fs)
 		return fs;
 
 	idmap_close(ctx->map);
+	idmaptrace_close(ctx->trace);
 	free(ctx);
 	return NULL;
 }
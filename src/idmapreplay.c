@@ -0,0 +1,187 @@
+/*
+ * idmap-replay - Replay fuse-idmap traces against libidmap
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "idmap.h"
+#include "idmaptrace.h"
+
+static const char* const op_names[IDMAPTRACE_NOPS] = {
+	[IDMAPTRACE_GETATTR]  = "getattr",
+	[IDMAPTRACE_FGETATTR] = "fgetattr",
+	[IDMAPTRACE_STATX]    = "statx",
+	[IDMAPTRACE_READDIR]  = "readdir",
+	[IDMAPTRACE_CHOWN]    = "chown",
+};
+
+static void usage(const char* self) {
+	fprintf(
+		stderr,
+		"Usage: %s [options] trace\n"
+		"    -u user.map       Path to UID remapping file\n"
+		"    -g group.map      Path to GID remapping file\n"
+		"    -p pairs.map      Path to remapping file for specific user:group pairs\n"
+		"    -t                apply the following maps to the result of the preceding ones\n"
+		"    -n passes         replay the trace this many times (default 1)\n"
+		"    -w out.trace      record the replay through the module's trace writer as well\n",
+		self
+	);
+}
+
+static struct idmaptrace_record* read_trace(const char* path, size_t* count) {
+	FILE* f = fopen(path, "rb");
+	if(!f)
+		return NULL;
+	struct idmaptrace_header header;
+	if(fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, IDMAPTRACE_MAGIC, sizeof(header.magic)) ||
+	   header.version != IDMAPTRACE_VERSION || header.record_size != sizeof(struct idmaptrace_record)) {
+		fclose(f);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct idmaptrace_record* records = NULL;
+	size_t cap = 0;
+	*count = 0;
+	for(;;) {
+		if(*count == cap) {
+			size_t newcap = cap ? cap*2 : 4096;
+			struct idmaptrace_record* newrecords = realloc(records, sizeof(*records)*newcap);
+			if(!newrecords)
+				goto err;
+			records = newrecords;
+			cap = newcap;
+		}
+		size_t n = fread(records + *count, sizeof(*records), cap - *count, f);
+		*count += n;
+		if(*count < cap)
+			break;
+	}
+	if(ferror(f))
+		goto err;
+	fclose(f);
+	return records;
+
+err:
+	free(records);
+	fclose(f);
+	return NULL;
+}
+
+static double elapsed(const struct timespec* start, const struct timespec* end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+	struct idmap_mapfiles* chain = NULL;
+	size_t nchain = 0;
+	unsigned long passes = 1;
+	const char* out_path = NULL;
+
+	int c;
+	while((c = getopt(argc, argv, "u:g:p:tn:w:")) != -1) {
+		if(c == 't' || (strchr("ugp", c) && !nchain)) {
+			struct idmap_mapfiles* newchain = realloc(chain, sizeof(*chain)*(nchain+1));
+			if(!newchain) {
+				perror("Error parsing options");
+				return 1;
+			}
+			chain = newchain;
+			chain[nchain++] = (struct idmap_mapfiles){0};
+		}
+		switch(c) {
+			case 'u': chain[nchain-1].user_map = optarg; break;
+			case 'g': chain[nchain-1].group_map = optarg; break;
+			case 'p': chain[nchain-1].user_group_map = optarg; break;
+			case 't': break;
+			case 'n': passes = strtoul(optarg, NULL, 10); break;
+			case 'w': out_path = optarg; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(optind != argc-1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct idmap* map = idmap_open_with_mapfile_chain(chain, nchain);
+	free(chain);
+	if(!map) {
+		perror("Error initializing idmap");
+		return 1;
+	}
+
+	size_t count;
+	struct idmaptrace_record* records = read_trace(argv[optind], &count);
+	if(!records) {
+		perror("Error reading trace");
+		idmap_close(map);
+		return 1;
+	}
+
+	struct idmaptrace* out = NULL;
+	if(out_path && !(out = idmaptrace_open(out_path))) {
+		perror("Error opening output trace");
+		free(records);
+		idmap_close(map);
+		return 1;
+	}
+
+	size_t ops[IDMAPTRACE_NOPS] = {0};
+	uint64_t first = UINT64_MAX, last = 0;
+	for(size_t i = 0; i < count; i++) {
+		const struct idmaptrace_record* r = records + i;
+		if(r->op < IDMAPTRACE_NOPS)
+			ops[r->op]++;
+		if(r->timestamp < first)
+			first = r->timestamp;
+		if(r->timestamp > last)
+			last = r->timestamp;
+	}
+
+	// Results are hashed so that different builds of libidmap can be checked for agreement on the same trace,
+	// which also keeps the lookups being timed from being optimized away
+	uint64_t checksum = UINT64_C(0xcbf29ce484222325);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(unsigned long pass = 0; pass < passes; pass++)
+		for(size_t i = 0; i < count; i++) {
+			uid_t uid = records[i].uid;
+			gid_t gid = records[i].gid;
+			if(out)
+				idmaptrace_record(out, records[i].op, uid, gid, records[i].invert);
+			idmap_map(map, &uid, &gid, records[i].invert);
+			checksum = (checksum ^ uid) * UINT64_C(0x100000001b3);
+			checksum = (checksum ^ gid) * UINT64_C(0x100000001b3);
+		}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	idmaptrace_close(out);
+
+	printf("records   %zu", count);
+	if(count > 1 && last > first)
+		printf(" over %.3f s (%.0f/s recorded)", (last - first) / 1e9, count / ((last - first) / 1e9));
+	printf("\n");
+	for(int op = 0; op < IDMAPTRACE_NOPS; op++)
+		if(ops[op])
+			printf("  %-8s %zu\n", op_names[op], ops[op]);
+	double seconds = elapsed(&start, &end);
+	printf("replayed  %lu pass%s in %.3f s", passes, passes == 1 ? "" : "es", seconds);
+	if(count && passes)
+		printf(", %.1f ns/lookup", seconds * 1e9 / ((double)count * passes));
+	printf("\nchecksum  %016llx\n", (unsigned long long)checksum);
+
+	free(records);
+	idmap_close(map);
+	return 0;
+}
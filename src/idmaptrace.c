@@ -0,0 +1,196 @@
+/*
+ * fuse-idmap - FUSE module for inter-system user/group ID mapping
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "idmaptrace.h"
+
+#define TRACE_BUFFER_RECORDS 4096
+
+// Each thread records into a buffer of its own, which is handed over to the writer thread once full.
+// Records are therefore in order per thread, but interleaved between threads in runs of up to a buffer's length.
+struct trace_buffer {
+	struct idmaptrace* trace;
+	struct trace_buffer* next,* all_next;
+	size_t count;
+	struct idmaptrace_record records[TRACE_BUFFER_RECORDS];
+};
+
+struct idmaptrace {
+	FILE* file;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t writer;
+	bool writer_started, stopping;
+	// Full buffers waiting to be written, oldest first
+	struct trace_buffer* queue,** queue_tail;
+	struct trace_buffer* free_buffers;
+	// Every buffer allocated, wherever it currently is
+	struct trace_buffer* all;
+};
+
+static void* trace_writer(void* opaque) {
+	struct idmaptrace* trace = opaque;
+	pthread_mutex_lock(&trace->lock);
+	for(;;) {
+		while(!trace->queue && !trace->stopping)
+			pthread_cond_wait(&trace->cond, &trace->lock);
+		struct trace_buffer* buffers = trace->queue,* last = NULL;
+		if(!buffers)
+			break;
+		trace->queue = NULL;
+		trace->queue_tail = &trace->queue;
+		pthread_mutex_unlock(&trace->lock);
+
+		for(struct trace_buffer* buf = buffers; buf; buf = buf->next) {
+			fwrite(buf->records, sizeof(*buf->records), buf->count, trace->file);
+			buf->count = 0;
+			last = buf;
+		}
+
+		pthread_mutex_lock(&trace->lock);
+		last->next = trace->free_buffers;
+		trace->free_buffers = buffers;
+	}
+	pthread_mutex_unlock(&trace->lock);
+	return NULL;
+}
+
+// Must be called with the lock held
+static void trace_queue(struct idmaptrace* trace, struct trace_buffer* buf) {
+	buf->next = NULL;
+	*trace->queue_tail = buf;
+	trace->queue_tail = &buf->next;
+	pthread_cond_signal(&trace->cond);
+}
+
+// Queues a full buffer if given, and returns an empty one to continue with
+static struct trace_buffer* trace_swap(struct idmaptrace* trace, struct trace_buffer* full) {
+	pthread_mutex_lock(&trace->lock);
+	// Started on first use rather than when opened, as FUSE may fork to daemonize in between
+	if(!trace->writer_started)
+		trace->writer_started = !pthread_create(&trace->writer, NULL, trace_writer, trace);
+	if(full && !trace->writer_started) {
+		fwrite(full->records, sizeof(*full->records), full->count, trace->file);
+		full->count = 0;
+		pthread_mutex_unlock(&trace->lock);
+		return full;
+	}
+	if(full)
+		trace_queue(trace, full);
+
+	struct trace_buffer* buf = trace->free_buffers;
+	if(buf)
+		trace->free_buffers = buf->next;
+	else if((buf = malloc(sizeof(*buf)))) {
+		buf->trace = trace;
+		buf->count = 0;
+		buf->all_next = trace->all;
+		trace->all = buf;
+	}
+	pthread_mutex_unlock(&trace->lock);
+	return buf;
+}
+
+static void trace_thread_exit(void* opaque) {
+	struct trace_buffer* buf = opaque;
+	struct idmaptrace* trace = buf->trace;
+	pthread_mutex_lock(&trace->lock);
+	if(buf->count)
+		trace_queue(trace, buf);
+	else {
+		buf->next = trace->free_buffers;
+		trace->free_buffers = buf;
+	}
+	pthread_mutex_unlock(&trace->lock);
+}
+
+struct idmaptrace* idmaptrace_open(const char* path) {
+	struct idmaptrace* trace = calloc(1, sizeof(*trace));
+	if(!trace)
+		return NULL;
+	if(!(trace->file = fopen(path, "wb")))
+		goto err;
+
+	struct idmaptrace_header header = { .version = IDMAPTRACE_VERSION, .record_size = sizeof(struct idmaptrace_record) };
+	memcpy(header.magic, IDMAPTRACE_MAGIC, sizeof(header.magic));
+	// Flushed now so that a fork doesn't leave the header buffered in both processes
+	if(fwrite(&header, sizeof(header), 1, trace->file) != 1 || fflush(trace->file))
+		goto err;
+
+	if(pthread_key_create(&trace->key, trace_thread_exit))
+		goto err;
+	if(pthread_mutex_init(&trace->lock, NULL)) {
+		pthread_key_delete(trace->key);
+		goto err;
+	}
+	if(pthread_cond_init(&trace->cond, NULL)) {
+		pthread_mutex_destroy(&trace->lock);
+		pthread_key_delete(trace->key);
+		goto err;
+	}
+	trace->queue_tail = &trace->queue;
+	return trace;
+
+err:
+	if(trace->file)
+		fclose(trace->file);
+	free(trace);
+	return NULL;
+}
+
+void idmaptrace_record(struct idmaptrace* trace, enum idmaptrace_op op, uid_t uid, gid_t gid, bool invert) {
+	struct trace_buffer* buf = pthread_getspecific(trace->key);
+	if(!buf || buf->count == TRACE_BUFFER_RECORDS) {
+		buf = trace_swap(trace, buf);
+		pthread_setspecific(trace->key, buf);
+		if(!buf)
+			return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	buf->records[buf->count++] = (struct idmaptrace_record){
+		.timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+		.uid = uid,
+		.gid = gid,
+		.op = op,
+		.invert = invert
+	};
+}
+
+void idmaptrace_close(struct idmaptrace* trace) {
+	if(!trace)
+		return;
+	pthread_key_delete(trace->key);
+
+	pthread_mutex_lock(&trace->lock);
+	trace->stopping = true;
+	pthread_cond_signal(&trace->cond);
+	bool started = trace->writer_started;
+	pthread_mutex_unlock(&trace->lock);
+	if(started)
+		pthread_join(trace->writer, NULL);
+
+	// The writer empties the queue before stopping, so what remains are buffers threads were still filling
+	for(struct trace_buffer* buf = trace->all,* next; buf; buf = next) {
+		next = buf->all_next;
+		fwrite(buf->records, sizeof(*buf->records), buf->count, trace->file);
+		free(buf);
+	}
+	bool failed = ferror(trace->file);
+	if(fclose(trace->file) || failed)
+		perror("Error writing idmap trace");
+
+	pthread_cond_destroy(&trace->cond);
+	pthread_mutex_destroy(&trace->lock);
+	free(trace);
+}
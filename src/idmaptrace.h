@@ -0,0 +1,44 @@
+/*
+ * fuse-idmap - FUSE module for inter-system user/group ID mapping
+ */
+
+#ifndef IDMAPTRACE_H
+#define IDMAPTRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Trace files are this header followed by fixed size records, both in host byte order
+#define IDMAPTRACE_MAGIC "IDMAPTRC"
+#define IDMAPTRACE_VERSION 1
+
+struct idmaptrace_header {
+	char magic[8];
+	uint32_t version, record_size;
+};
+
+enum idmaptrace_op {
+	IDMAPTRACE_GETATTR,
+	IDMAPTRACE_FGETATTR,
+	IDMAPTRACE_STATX,
+	IDMAPTRACE_READDIR,
+	IDMAPTRACE_CHOWN,
+	IDMAPTRACE_NOPS
+};
+
+// uid, gid and invert are the arguments given to idmap_map, before mapping
+struct idmaptrace_record {
+	uint64_t timestamp; // CLOCK_MONOTONIC, in nanoseconds
+	uint32_t uid, gid;
+	uint8_t op, invert;
+	uint8_t reserved[6];
+};
+
+struct idmaptrace;
+
+struct idmaptrace* idmaptrace_open(const char* path);
+void idmaptrace_record(struct idmaptrace*, enum idmaptrace_op op, uid_t uid, gid_t gid, bool invert);
+void idmaptrace_close(struct idmaptrace*);
+
+#endif